@@ -30,6 +30,25 @@ bool sendData = true;
 unsigned long myChannelNumber = SECRET_CH_ID;
 const char * myWriteAPIKey = THINGSPEAK_API_WRITE;
 
+// reduced-memory tls profile. BearSSL defaults to a 16k receive buffer, which is a big chunk of the heap.
+// if the server supports max fragment length negotiation (MFLN) we can shrink it to 512 bytes.
+// test/test_tls_bench measures the other sizes.
+const uint16_t TLS_RX_BUFFER_SIZE = 512;
+const uint16_t TLS_TX_BUFFER_SIZE = 512; // our payloads are small, 512 is plenty for sending
+
+// per host cache of the probe result, so we don't probe the server on every upload
+// bufferSize of 0 means the server doesn't support MFLN and we use the default buffers, an empty host is a free slot
+struct TLSHostProfile {
+  String host;
+  uint16_t port;
+  uint16_t bufferSize;
+  unsigned long probedAt; // millis() of the probe
+};
+const int TLS_CACHE_SIZE = 4;
+const unsigned long TLS_REPROBE_INTERVAL = 60UL * 60UL * 1000UL; // one hour, see getTLSBufferSize
+TLSHostProfile tlsCache[TLS_CACHE_SIZE];
+int tlsCacheNext = 0; // next slot to use for a new host
+
 int number = 0;
 int delayTime = 10000 * 2; // delay between writes to ThingSpeak in ms
 
@@ -42,6 +61,11 @@ String getValue(String data, char separator, int index);
 void wifiStatusLED();
 void updateRate(int rate);
 void writeDataToFireBaseDatabase(String payload, String endpoint, bool &success);
+bool parseUrl(String url, String &host, uint16_t &port);
+int findTLSHost(String host, uint16_t port);
+uint16_t getTLSBufferSize(String host, uint16_t port);
+bool configureTLSClient(BearSSL::WiFiClientSecure &client, String url);
+bool retryWithDefaultBuffers(BearSSL::WiFiClientSecure &client, String url, int httpCode);
 
 // update the delay time between writes to ThingSpeak, in ms. default is 10000
 void updateRate(int rate) {
@@ -83,31 +107,41 @@ void thingSpeakWriteREST(String data) {
   prepareJSON(data);
   String payload;
   serializeJson(doc, payload);
-  std::unique_ptr<BearSSL::WiFiClientSecure> client(new BearSSL::WiFiClientSecure);
-  client->setInsecure();
-
-  HTTPClient https;
   String endpoint = "https://api.thingspeak.com/update.json";
 
-  if (https.begin(*client, endpoint)) {
-    https.addHeader("Content-Type", "application/json");
-    int httpCode = https.POST(payload);
-    if (httpCode > 0) {
-      Serial.printf("[HTTPS] GET... code: %d\n", httpCode);
-      // file found at server
-      if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY) {
-        String serverUpdate = https.getString();
-        Serial.println(serverUpdate);
-        //success = true; // this should be passed in as a reference
+  // the first attempt uses the reduced tls profile, if that fails we try once more with the default buffers
+  for (int attempt = 0; attempt < 2; attempt++) {
+    std::unique_ptr<BearSSL::WiFiClientSecure> client(new BearSSL::WiFiClientSecure);
+    client->setInsecure();
+    bool reducedBuffers = (attempt == 0) && configureTLSClient(*client, endpoint);
+
+    HTTPClient https;
+
+    if (https.begin(*client, endpoint)) {
+      https.addHeader("Content-Type", "application/json");
+      int httpCode = https.POST(payload);
+      bool retry = reducedBuffers && retryWithDefaultBuffers(*client, endpoint, httpCode);
+      if (httpCode > 0) {
+        Serial.printf("[HTTPS] GET... code: %d\n", httpCode);
+        // file found at server
+        if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY) {
+          String serverUpdate = https.getString();
+          Serial.println(serverUpdate);
+          //success = true; // this should be passed in as a reference
+        }
+      } else {
+        Serial.printf("[HTTPS] GET... failed, error: %s\n", https.errorToString(httpCode).c_str());
       }
-    } else {
-      Serial.printf("[HTTPS] GET... failed, error: %s\n", https.errorToString(httpCode).c_str());
-    }
 
-    https.end();
+      https.end();
+      if (retry) {
+        continue;
+      }
 
-  } else {
-    Serial.printf("[HTTPS] Unable to connect\n");
+    } else {
+      Serial.printf("[HTTPS] Unable to connect\n");
+    }
+    break;
   }
   
 }
@@ -149,6 +183,140 @@ String getValue(String data, char separator, int index)
   return found>index ? data.substring(strIndex[0], strIndex[1]) : "";
 }
 
+// splits a url into host and port, ex: https://api.thingspeak.com/update.json -> api.thingspeak.com, 443
+// the port defaults to 443 when the url doesn't have one. returns false if the port isn't a number from 1 to 65535
+bool parseUrl(String url, String &host, uint16_t &port) {
+  int start = url.indexOf("://");
+  start = (start == -1) ? 0 : start + 3;
+  int end = url.length();
+  const char terminators[] = {'/', '?', '#'};
+  for (char terminator : terminators) {
+    int index = url.indexOf(terminator, start);
+    if (index != -1 && index < end) {
+      end = index;
+    }
+  }
+  host = url.substring(start, end);
+  port = 443;
+  int portIndex = host.indexOf(':');
+  if (portIndex != -1) {
+    String portString = host.substring(portIndex + 1);
+    host = host.substring(0, portIndex);
+    if (portString.length() == 0 || portString.length() > 5) {
+      return false;
+    }
+    for (unsigned int i = 0; i < portString.length(); i++) {
+      if (!isDigit(portString.charAt(i))) {
+        return false;
+      }
+    }
+    long value = portString.toInt();
+    if (value < 1 || value > 65535) {
+      return false;
+    }
+    port = value;
+  }
+  return host.length() > 0;
+}
+
+// returns the cache slot for the host, or -1 if it isn't cached
+int findTLSHost(String host, uint16_t port) {
+  for (int i = 0; i < TLS_CACHE_SIZE; i++) {
+    if (tlsCache[i].host.length() > 0 && tlsCache[i].host == host && tlsCache[i].port == port) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// returns TLS_RX_BUFFER_SIZE if the host supports MFLN, or 0 if it doesn't.
+// the probe opens a connection to the server, so the result is cached per host and port.
+uint16_t getTLSBufferSize(String host, uint16_t port) {
+  // every result expires, a server (or the backend behind a load balanced name) can change either way
+  int slot = findTLSHost(host, port);
+  if (slot != -1 && millis() - tlsCache[slot].probedAt < TLS_REPROBE_INTERVAL) {
+    return tlsCache[slot].bufferSize;
+  }
+
+  // if the name doesn't resolve we're probably offline, use the default buffers this time and don't cache anything
+  IPAddress ip;
+  if (!WiFi.hostByName(host.c_str(), ip)) {
+    Serial.printf("[TLS] unable to resolve %s, not probing MFLN\n", host.c_str());
+    return 0;
+  }
+
+  // a server accepts all of the MFLN sizes or none of them (RFC 6066), so one probe with the smallest is enough.
+  // a wrong "no" only costs memory until the entry expires, a wrong "yes" is caught by retryWithDefaultBuffers
+  uint16_t bufferSize = 0;
+  if (BearSSL::WiFiClientSecure::probeMaxFragmentLength(ip, port, TLS_RX_BUFFER_SIZE)) {
+    bufferSize = TLS_RX_BUFFER_SIZE;
+    Serial.printf("[TLS] %s:%u supports MFLN, using %u byte buffers\n", host.c_str(), port, bufferSize);
+  } else {
+    Serial.printf("[TLS] %s:%u does not support MFLN, using default buffers\n", host.c_str(), port);
+  }
+
+  // new host, use an empty slot if there is one, otherwise evict round robin
+  if (slot == -1) {
+    for (int i = 0; i < TLS_CACHE_SIZE && slot == -1; i++) {
+      if (tlsCache[i].host.length() == 0) {
+        slot = i;
+      }
+    }
+    if (slot == -1) {
+      slot = tlsCacheNext;
+      tlsCacheNext = (tlsCacheNext + 1) % TLS_CACHE_SIZE;
+      Serial.printf("[TLS] cache full, evicting %s:%u\n", tlsCache[slot].host.c_str(), tlsCache[slot].port);
+    }
+  }
+  tlsCache[slot].host = host;
+  tlsCache[slot].port = port;
+  tlsCache[slot].bufferSize = bufferSize;
+  tlsCache[slot].probedAt = millis();
+  return bufferSize;
+}
+
+// shrinks the BearSSL buffers for the host in the url, has to be called before the connection is opened.
+// if the server doesn't support MFLN the client is left alone with the default (16k) buffers.
+// returns true if the buffers were shrunk
+bool configureTLSClient(BearSSL::WiFiClientSecure &client, String url) {
+  String host;
+  uint16_t port;
+  if (!parseUrl(url, host, port)) {
+    Serial.printf("[TLS] unable to parse %s, using default buffers\n", url.c_str());
+    return false;
+  }
+  uint16_t bufferSize = getTLSBufferSize(host, port);
+  if (bufferSize > 0) {
+    client.setBufferSizes(bufferSize, TLS_TX_BUFFER_SIZE);
+    return true;
+  }
+  return false;
+}
+
+// called after a request made with shrunk buffers. if the request failed, or the connection didn't actually
+// negotiate MFLN, the host is dropped from the cache so it gets probed again.
+// returns true if the request failed and should be retried with the default buffers
+bool retryWithDefaultBuffers(BearSSL::WiFiClientSecure &client, String url, int httpCode) {
+  bool failed = httpCode < 0;
+  bool notNegotiated = client.connected() && !client.getMFLNStatus();
+  if (!failed && !notNegotiated) {
+    return false;
+  }
+
+  String host;
+  uint16_t port;
+  if (parseUrl(url, host, port)) {
+    int slot = findTLSHost(host, port);
+    if (slot != -1) {
+      tlsCache[slot].host = "";
+    }
+  }
+  Serial.printf("[TLS] MFLN failed for %s, dropping it from the cache\n", host.c_str());
+  if (failed) {
+    Serial.printf("[TLS] retrying with default buffers\n");
+  }
+  return failed;
+}
 
 void wifiStatusLED() {
   Serial.println("wifiStatusLED");
@@ -194,45 +362,54 @@ String preparePayload(String data) {
 //#define TEMP_ENDPOINT "/data/temps/current_temp.json"
 void Networking::writeDataToFireBaseDatabase(String payload, String endpoint, bool &success) {
 
-  std::unique_ptr<BearSSL::WiFiClientSecure> client(new BearSSL::WiFiClientSecure);
+  String databaseEndpoint = String(DATABASE_ROOT) + endpoint;
 
-  //client->setFingerprint(fingerprint);
-  // Or, if you happy to ignore the SSL certificate, then use the following line instead:
-  client->setInsecure();
+  String preparedPayload = preparePayload(payload);
 
-  HTTPClient https;
+  // the first attempt uses the reduced tls profile, if that fails we try once more with the default buffers
+  for (int attempt = 0; attempt < 2; attempt++) {
+    std::unique_ptr<BearSSL::WiFiClientSecure> client(new BearSSL::WiFiClientSecure);
 
-  String databaseEndpoint = String(DATABASE_ROOT) + endpoint;
+    //client->setFingerprint(fingerprint);
+    // Or, if you happy to ignore the SSL certificate, then use the following line instead:
+    client->setInsecure();
+    bool reducedBuffers = (attempt == 0) && configureTLSClient(*client, databaseEndpoint);
 
-  String preparedPayload = preparePayload(payload);
+    HTTPClient https;
 
-  Serial.print("[HTTPS] begin...\n");
-  if (https.begin(*client, databaseEndpoint)) {  // HTTPS
+    Serial.print("[HTTPS] begin...\n");
+    if (https.begin(*client, databaseEndpoint)) {  // HTTPS
 
-    https.addHeader("Content-Type", "application/json");
-    Serial.print("[HTTPS] GET...\n");
-    // start connection and send HTTP header
-    int httpCode = https.PUT(preparedPayload);  // post vs put, post gives a child and put overwrites
+      https.addHeader("Content-Type", "application/json");
+      Serial.print("[HTTPS] GET...\n");
+      // start connection and send HTTP header
+      int httpCode = https.PUT(preparedPayload);  // post vs put, post gives a child and put overwrites
+      bool retry = reducedBuffers && retryWithDefaultBuffers(*client, databaseEndpoint, httpCode);
 
-    // httpCode will be negative on error
-    if (httpCode > 0) {
-      // HTTP header has been send and Server response header has been handled
-      Serial.printf("[HTTPS] GET... code: %d\n", httpCode);
+      // httpCode will be negative on error
+      if (httpCode > 0) {
+        // HTTP header has been send and Server response header has been handled
+        Serial.printf("[HTTPS] GET... code: %d\n", httpCode);
 
 
-      // file found at server
-      if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY) {
-        String payload = https.getString();
-        Serial.println(payload);
-        success = true; // this should be passed in as a reference
+        // file found at server
+        if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY) {
+          String payload = https.getString();
+          Serial.println(payload);
+          success = true; // this should be passed in as a reference
+        }
+      } else {
+        Serial.printf("[HTTPS] GET... failed, error: %s\n", https.errorToString(httpCode).c_str());
       }
-    } else {
-      Serial.printf("[HTTPS] GET... failed, error: %s\n", https.errorToString(httpCode).c_str());
-    }
 
-    https.end();
+      https.end();
+      if (retry) {
+        continue;
+      }
 
-  } else {
-    Serial.printf("[HTTPS] Unable to connect\n");
+    } else {
+      Serial.printf("[HTTPS] Unable to connect\n");
+    }
+    break;
   }
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+// tls buffer size benchmark, measures handshake time and heap use for each BearSSL buffer size.
+//
+// needs a tls server on the local network, ex on a laptop:
+//   openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -days 30 -subj /CN=bench
+//   openssl s_server -accept 4433 -cert cert.pem -key key.pem -www
+// then set TLS_BENCH_HOST / TLS_BENCH_PORT (the address of that machine) in the tls_bench env in platformio.ini and run:
+//   pio test -e tls_bench
+// wifi credentials come from src/secureConfig.h
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiClientSecureBearSSL.h>
+#include <Ticker.h>
+#include <unity.h>
+#include "secureConfig.h"
+
+// set in the tls_bench env in platformio.ini
+#if !defined(TLS_BENCH_HOST) || !defined(TLS_BENCH_PORT)
+#error "TLS_BENCH_HOST and TLS_BENCH_PORT have to be set, run with pio test -e tls_bench"
+#endif
+
+const uint16_t TX_BUFFER_SIZE = 512; // same as the upload path in networking.cpp
+
+IPAddress benchIp;
+
+// heap is sampled from a timer while connect() runs, the timer fires whenever the handshake waits on the network
+Ticker heapSampler;
+volatile uint32_t lowestFreeHeap = 0;
+volatile uint32_t lowestMaxFreeBlock = 0;
+
+void sampleHeap() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t maxFreeBlock = ESP.getMaxFreeBlockSize();
+  if (freeHeap < lowestFreeHeap) {
+    lowestFreeHeap = freeHeap;
+  }
+  if (maxFreeBlock < lowestMaxFreeBlock) {
+    lowestMaxFreeBlock = maxFreeBlock;
+  }
+}
+
+// connects once with the given receive buffer size (0 = BearSSL default) and prints the results.
+// only client.connect() is timed, the address is resolved beforehand so dns isn't included.
+void runHandshake(uint16_t rxBufferSize) {
+  // sample before the client is created, the constructor already allocates the context and the BearSSL stack
+  uint32_t heapBefore = ESP.getFreeHeap();
+  lowestFreeHeap = heapBefore;
+  lowestMaxFreeBlock = ESP.getMaxFreeBlockSize();
+
+  std::unique_ptr<BearSSL::WiFiClientSecure> client(new BearSSL::WiFiClientSecure);
+  sampleHeap();
+  client->setInsecure();
+  if (rxBufferSize > 0) {
+    client->setBufferSizes(rxBufferSize, TX_BUFFER_SIZE);
+  }
+
+  heapSampler.attach_ms(1, sampleHeap);
+  unsigned long start = micros();
+  bool connected = client->connect(benchIp, TLS_BENCH_PORT);
+  unsigned long handshakeTime = micros() - start;
+  sampleHeap(); // the buffers are still allocated here
+  heapSampler.detach();
+
+  bool mflnNegotiated = connected && client->getMFLNStatus();
+  client->stop();
+  client.reset();
+
+  char message[192];
+  snprintf(message, sizeof(message), "rx buffer %5u: handshake %lu ms, mfln %s, peak heap use %u, lowest free heap %u, lowest max free block %u",
+    rxBufferSize, handshakeTime / 1000, mflnNegotiated ? "yes" : "no", heapBefore - lowestFreeHeap, lowestFreeHeap, lowestMaxFreeBlock);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE_MESSAGE(connected, "tls connect failed, is the bench server running?");
+  // without MFLN the numbers for the small buffers don't mean anything, the server could send records that don't fit
+  if (rxBufferSize > 0) {
+    TEST_ASSERT_TRUE_MESSAGE(mflnNegotiated, "MFLN wasn't negotiated for this buffer size");
+  }
+}
+
+// plain tcp connect time, to subtract from the handshake numbers
+void test_tcp_connect() {
+  WiFiClient client;
+  unsigned long start = micros();
+  bool connected = client.connect(benchIp, TLS_BENCH_PORT);
+  unsigned long connectTime = micros() - start;
+  client.stop();
+
+  char message[64];
+  snprintf(message, sizeof(message), "tcp connect %lu us", connectTime);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE_MESSAGE(connected, "tcp connect failed, is the bench server running?");
+}
+
+// not required for the numbers, but the small buffers only work if the server negotiates MFLN
+void test_server_supports_mfln() {
+  TEST_ASSERT_TRUE_MESSAGE(BearSSL::WiFiClientSecure::probeMaxFragmentLength(benchIp, TLS_BENCH_PORT, 512),
+    "bench server doesn't support MFLN");
+}
+
+void test_handshake_512() { runHandshake(512); }
+void test_handshake_1024() { runHandshake(1024); }
+void test_handshake_2048() { runHandshake(2048); }
+void test_handshake_4096() { runHandshake(4096); }
+void test_handshake_default() { runHandshake(0); }
+
+void setup() {
+  delay(2000); // give the test runner time to open the serial port
+
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(100);
+  }
+  WiFi.hostByName(TLS_BENCH_HOST, benchIp);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_tcp_connect);
+  RUN_TEST(test_server_supports_mfln);
+  RUN_TEST(test_handshake_512);
+  RUN_TEST(test_handshake_1024);
+  RUN_TEST(test_handshake_2048);
+  RUN_TEST(test_handshake_4096);
+  RUN_TEST(test_handshake_default);
+  UNITY_END();
+}
+
+void loop() {
+}